@@ -6,12 +6,20 @@
 #include "cnpy.h"
 #include <stdint.h>
 #include <algorithm>
+#include <atomic>
 #include <complex>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <iomanip>
 #include <regex>
 #include <stdexcept>
+#include <zlib.h>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace cnpy {
 
@@ -64,19 +72,16 @@ char map_type(const std::type_info& t) {
 }
 
 uint32_t crc32(uint32_t crc, const void* data, size_t length) {
-    static const uint32_t tinf_crc32tab[16] = {0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
-                                               0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
-                                               0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
-                                               0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
-    const unsigned char* buf = (const unsigned char*)data;
-    crc = ~crc;
-    for (size_t i = 0; i < length; ++i) {
-        crc ^= buf[i];
-        crc = tinf_crc32tab[crc & 0x0f] ^ (crc >> 4);
-        crc = tinf_crc32tab[crc & 0x0f] ^ (crc >> 4);
+    // zlib's table-driven crc32 is many times faster than a nibble table; it takes uInt lengths
+    const Bytef* buf = (const Bytef*)data;
+    while (length > 0) {
+        uInt chunk = (uInt)std::min<size_t>(length, 1u << 30);
+        crc = (uint32_t)::crc32(crc, buf, chunk);
+        buf += chunk;
+        length -= chunk;
     }
-    // return value suitable for passing in next time, for final value invert it
-    return crc ^ 0xffffffff;
+    // return value suitable for passing in next time
+    return crc;
 }
 
 void parse_npy_header(std::istream& is, size_t& word_size, std::vector<size_t>& shape,
@@ -175,15 +180,131 @@ std::string parse_local_header(std::istream& is, uint16_t& compr_method, uint32_
     compr_method = *reinterpret_cast<uint16_t*>(&local_header[8]);
     compr_bytes = *reinterpret_cast<uint32_t*>(&local_header[18]);
     uncompr_bytes = *reinterpret_cast<uint32_t*>(&local_header[22]);
-    if (compr_method != 0) {
-        throw std::runtime_error("npz_load: unsupported gzip compress's npz.");
-        // ss.read(buffer_compr.data(), compr_bytes);
-        // arrays[varname] = load_the_npz_array((unsigned
-        // char*)buffer_compr.data(),compr_bytes,uncompr_bytes);
+    if (compr_method != 0 && compr_method != Z_DEFLATED) {
+        throw std::runtime_error("npz_load: unsupported compression method " +
+                                 std::to_string(compr_method));
     }
     return var_name;
 }
 
+// raw deflate (no zlib header) of the concatenation of `head` and `nbytes` of `data`
+std::string deflate_bytes(const std::string& head, const char* data, size_t nbytes, int level) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("deflate_bytes: deflateInit2 failed");
+    }
+    std::string out(deflateBound(&zs, head.size() + nbytes), '\0');
+    zs.next_out = (Bytef*)&out[0];
+    const char* inputs[2] = {head.data(), data};
+    size_t sizes[2] = {head.size(), nbytes};
+    for (int i = 0; i < 2; ++i) {
+        const char* p = inputs[i];
+        size_t left = sizes[i];
+        int flush = Z_NO_FLUSH;
+        do {
+            uInt chunk = (uInt)std::min<size_t>(left, 1u << 30);
+            zs.next_in = (Bytef*)p;
+            zs.avail_in = chunk;
+            p += chunk;
+            left -= chunk;
+            flush = (i == 1 && left == 0) ? Z_FINISH : Z_NO_FLUSH;
+            while (zs.avail_in > 0 || flush == Z_FINISH) {
+                zs.avail_out = (uInt)std::min<size_t>(out.size() - zs.total_out, 1u << 30);
+                int ret = deflate(&zs, flush);
+                if (ret == Z_STREAM_END) break;
+                if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                    deflateEnd(&zs);
+                    throw std::runtime_error("deflate_bytes: deflate failed");
+                }
+            }
+        } while (left > 0);
+    }
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return out;
+}
+
+void inflate_bytes(const char* src, size_t compr_bytes, char* dst, size_t uncompr_bytes) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+        throw std::runtime_error("inflate_bytes: inflateInit2 failed");
+    }
+    zs.next_in = (Bytef*)src;
+    zs.next_out = (Bytef*)dst;
+    int ret = Z_OK;
+    while (ret == Z_OK) {
+        zs.avail_in = (uInt)std::min<size_t>(compr_bytes - zs.total_in, 1u << 30);
+        zs.avail_out = (uInt)std::min<size_t>(uncompr_bytes - zs.total_out, 1u << 30);
+        ret = inflate(&zs, Z_NO_FLUSH);
+    }
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.total_out != uncompr_bytes) {
+        throw std::runtime_error("npz_load: corrupt deflated member");
+    }
+}
+
+uint16_t compress_member(const std::string& fname, const std::string& npy_header,
+                         const char* data, size_t nbytes, const SavePolicy& policy,
+                         std::string& compressed, save_stats_t* stats) {
+    size_t uncompr_bytes = npy_header.size() + nbytes;
+    uint16_t compr_method = 0;
+    int level = 0;
+    if (policy.level > 0) {
+        level = policy.level;
+        if (policy.adaptive && nbytes > 0) {
+            // estimate from a few evenly spaced slices rather than compressing everything
+            const size_t num_slices = 8;
+            std::string sample;
+            if (nbytes <= policy.sample_bytes) {
+                sample.assign(data, nbytes);
+            } else {
+                size_t slice = std::max<size_t>(policy.sample_bytes / num_slices, 1);
+                size_t stride = nbytes / num_slices;
+                for (size_t i = 0; i < num_slices; ++i) {
+                    sample.append(data + i * stride, std::min(slice, nbytes - i * stride));
+                }
+            }
+            double fast_ratio = (double)deflate_bytes("", &sample[0], sample.size(), 1).size() /
+                                sample.size();
+            if (fast_ratio > policy.max_ratio) {
+                level = 0;
+            } else if (level > 1) {
+                double ratio = (double)deflate_bytes("", &sample[0], sample.size(), level).size() /
+                               sample.size();
+                if (fast_ratio - ratio < policy.min_level_gain) {
+                    level = 1;
+                }
+            }
+        }
+    }
+    if (level > 0) {
+        compressed = deflate_bytes(npy_header, data, nbytes, level);
+        if (compressed.size() < uncompr_bytes) {
+            compr_method = Z_DEFLATED;
+        } else {
+            compressed.clear();
+            level = 0;
+        }
+    }
+    if (stats) {
+        MemberStats member;
+        member.name = fname;
+        if (member.name.size() >= 4 &&
+            member.name.compare(member.name.size() - 4, 4, ".npy") == 0) {
+            member.name.erase(member.name.end() - 4, member.name.end());
+        }
+        member.compr_method = compr_method;
+        member.level = level;
+        member.uncompr_bytes = uncompr_bytes;
+        member.compr_bytes = compr_method ? compressed.size() : uncompr_bytes;
+        member.ratio = uncompr_bytes ? (double)member.compr_bytes / uncompr_bytes : 1.0;
+        stats->push_back(member);
+    }
+    return compr_method;
+}
+
 NpyArray load_the_npy_stream(std::istream& is) {
     std::vector<size_t> shape{};
     size_t word_size;
@@ -195,18 +316,132 @@ NpyArray load_the_npy_stream(std::istream& is) {
     return arr;
 }
 
+// one record of the zip central directory
+struct ZipEntry {
+    std::string var_name;          // member name with ".npy" stripped
+    std::string global_header;     // raw central directory record
+    uint16_t compr_method;         // compression method
+    uint32_t crc;                  // crc32 of the uncompressed member
+    uint32_t compr_bytes;          // compressed size
+    uint32_t uncompr_bytes;        // uncompressed size
+    uint32_t local_header_offset;  // offset of the local header in the archive
+    size_t global_header_offset;   // offset of this record in the archive
+};
+
+std::vector<ZipEntry> parse_global_header(std::istream& is, uint16_t nrecs,
+                                          size_t global_header_size,
+                                          size_t global_header_offset) {
+    std::string global_header(global_header_size, ' ');
+    is.seekg(global_header_offset, std::ios::beg);
+    is.read(&global_header[0], global_header_size);
+    if (!is) {
+        throw std::runtime_error("parse_global_header: truncated central directory");
+    }
+
+    std::vector<ZipEntry> entries;
+    size_t pos = 0;
+    for (uint16_t i = 0; i < nrecs; ++i) {
+        if (pos + 46 > global_header.size() || global_header.compare(pos, 4, "PK\x01\x02") != 0) {
+            throw std::runtime_error("parse_global_header: corrupt central directory");
+        }
+        const char* rec = &global_header[pos];
+        uint16_t name_len = *(uint16_t*)&rec[28];
+        uint16_t extra_field_len = *(uint16_t*)&rec[30];
+        uint16_t comment_len = *(uint16_t*)&rec[32];
+        size_t rec_size = 46 + name_len + extra_field_len + comment_len;
+
+        ZipEntry entry;
+        entry.var_name = global_header.substr(pos + 46, name_len);
+        if (entry.var_name.size() >= 4 &&
+            entry.var_name.compare(entry.var_name.size() - 4, 4, ".npy") == 0) {
+            entry.var_name.erase(entry.var_name.end() - 4, entry.var_name.end());
+        }
+        entry.global_header = global_header.substr(pos, rec_size);
+        entry.compr_method = *(uint16_t*)&rec[10];
+        entry.crc = *(uint32_t*)&rec[16];
+        entry.compr_bytes = *(uint32_t*)&rec[20];
+        entry.uncompr_bytes = *(uint32_t*)&rec[24];
+        entry.local_header_offset = *(uint32_t*)&rec[42];
+        entry.global_header_offset = global_header_offset + pos;
+        entries.push_back(entry);
+        pos += rec_size;
+    }
+    return entries;
+}
+
+std::vector<ZipEntry> read_zip_entries(std::istream& is) {
+    uint16_t nrecs;
+    size_t global_header_size, global_header_offset;
+    parse_zip_footer(is, nrecs, global_header_size, global_header_offset);
+    return parse_global_header(is, nrecs, global_header_size, global_header_offset);
+}
+
+// total length of the npy header starting at buf, or 0 if buf is too short to tell
+size_t npy_header_length(const char* buf, size_t size) {
+    if (size >= 12 && buf[6] >= 2) {
+        return 12 + *(uint32_t*)&buf[8];
+    }
+    return size >= 10 ? 10 + *(uint16_t*)&buf[8] : 0;
+}
+
+NpyArray load_the_deflated_npy(std::istream& is, size_t compr_bytes, size_t uncompr_bytes) {
+    std::vector<char> compressed(compr_bytes);
+    is.read(compressed.data(), compr_bytes);
+    std::string buffer(uncompr_bytes, '\0');
+    inflate_bytes(compressed.data(), compr_bytes, &buffer[0], uncompr_bytes);
+    compressed.clear();
+    compressed.shrink_to_fit();
+    // parse the header from its own stream so the payload is copied only once
+    size_t header_len = npy_header_length(buffer.data(), buffer.size());
+    if (header_len == 0 || header_len > buffer.size()) {
+        throw std::runtime_error("npz_load: corrupt npy header in deflated member");
+    }
+    std::istringstream iss(buffer.substr(0, header_len));
+    std::vector<size_t> shape{};
+    size_t word_size;
+    bool fortran_order;
+    char type_class;
+    parse_npy_header(iss, word_size, shape, type_class, fortran_order);
+    NpyArray arr(shape, word_size, fortran_order, type_class);
+    if (header_len + arr.num_bytes() > buffer.size()) {
+        throw std::runtime_error("npz_load: deflated member shorter than its npy header");
+    }
+    memcpy(arr.data<char>(), &buffer[header_len], arr.num_bytes());
+    return arr;
+}
+
+NpyArray load_the_npz_member(std::istream& is, const ZipEntry& entry) {
+    is.seekg(entry.local_header_offset, std::ios::beg);
+    uint16_t compr_method = 0;
+    uint32_t compr_bytes = 0, uncompr_bytes = 0;
+    parse_local_header(is, compr_method, compr_bytes, uncompr_bytes);
+    // sizes come from the central directory, the local header may defer them
+    if (entry.compr_method == Z_DEFLATED) {
+        return load_the_deflated_npy(is, entry.compr_bytes, entry.uncompr_bytes);
+    }
+    return load_the_npy_stream(is);
+}
+
+void copy_stream_bytes(std::istream& is, std::ostream& os, size_t nbytes) {
+    std::vector<char> buffer(std::min<size_t>(nbytes, 1 << 20));
+    while (nbytes > 0) {
+        size_t chunk = std::min(nbytes, buffer.size());
+        is.read(&buffer[0], chunk);
+        if (!is) {
+            throw std::runtime_error("copy_stream_bytes: unexpected end of file");
+        }
+        os.write(&buffer[0], chunk);
+        nbytes -= chunk;
+    }
+}
+
 npz_t npz_load_buffer(std::string& serialize_data) {
+    // sizes come from the central directory, as in npz_load: numpy writes zip64 local headers
+    // whose size fields are only placeholders
     npz_t arrays;
     std::stringstream ss(serialize_data);
-    while (1) {
-        uint16_t compr_method = 0;
-        uint32_t compr_bytes = 0, uncompr_bytes = 0;
-        std::string var_name = parse_local_header(ss, compr_method, compr_bytes, uncompr_bytes);
-        // if var_name == "", stop reading.
-        if (var_name == "") {
-            break;
-        }
-        arrays[var_name] = load_the_npy_stream(ss);
+    for (const ZipEntry& entry : read_zip_entries(ss)) {
+        arrays[entry.var_name] = load_the_npz_member(ss, entry);
     }
     return arrays;
 }
@@ -217,16 +452,11 @@ npz_t npz_load(const std::string& fname) {
     if (!ifs.is_open()) {
         throw std::runtime_error("npz_load: Unable to open file " + fname);
     }
+    // walk the central directory rather than the local headers, so members retired by
+    // npz_update are skipped. later records win, as they did for duplicate local headers.
     npz_t arrays;
-    while (1) {
-        uint16_t compr_method = 0;
-        uint32_t compr_bytes = 0, uncompr_bytes = 0;
-        std::string var_name = parse_local_header(ifs, compr_method, compr_bytes, uncompr_bytes);
-        // if var_name == "", stop reading.
-        if (var_name == "") {
-            break;
-        }
-        arrays[var_name] = load_the_npy_stream(ifs);
+    for (const ZipEntry& entry : read_zip_entries(ifs)) {
+        arrays[entry.var_name] = load_the_npz_member(ifs, entry);
     }
     ifs.close();
     return arrays;
@@ -238,19 +468,12 @@ NpyArray npz_load(const std::string& fname, const std::string& varname) {
     if (!ifs.is_open()) {
         throw std::runtime_error("npz_load: Unable to open file " + fname);
     }
-    while (1) {
-        uint16_t compr_method = 0;
-        uint32_t compr_bytes = 0, uncompr_bytes = 0;
-        std::string var_name = parse_local_header(ifs, compr_method, compr_bytes, uncompr_bytes);
-        // if var_name == "", stop reading.
-        if (var_name == "") {
-            break;
-        }
-        if (var_name != varname) {
-            ifs.seekg(uncompr_bytes, std::ios::cur);
+    std::vector<ZipEntry> entries = read_zip_entries(ifs);
+    for (auto iter = entries.rbegin(); iter != entries.rend(); ++iter) {
+        if (iter->var_name != varname) {
             continue;
         }
-        NpyArray array = load_the_npy_stream(ifs);
+        NpyArray array = load_the_npz_member(ifs, *iter);
         ifs.close();
         return array;
     }
@@ -259,7 +482,591 @@ NpyArray npz_load(const std::string& fname, const std::string& varname) {
     throw std::runtime_error("npz_load: Variable name " + varname + " not found in " + fname);
 }
 
-NpyArray npy_load(const std::string& fname) {
+// extra field of `padding` bytes laid out as zipalign does: id, size, alignment, zeros
+const uint16_t padding_id = 0xd935;
+
+std::string padding_record(uint16_t padding, uint16_t alignment) {
+    std::string record(padding, '\0');
+    uint16_t padding_size = padding - 4;
+    memcpy(&record[0], &padding_id, 2);
+    memcpy(&record[2], &padding_size, 2);
+    memcpy(&record[4], &alignment, 2);
+    return record;
+}
+
+// the alignment recorded in a local extra field written by padding_record, or 0
+uint16_t padding_alignment(const char* extra, uint16_t extra_field_len) {
+    if (extra_field_len < 6 || *(uint16_t*)&extra[0] != padding_id ||
+        *(uint16_t*)&extra[2] != extra_field_len - 4) {
+        return 0;
+    }
+    return *(uint16_t*)&extra[4];
+}
+
+void npz_update(std::string zipname, std::string varname, const char* data,
+                const std::vector<size_t>& shape, char type_class, size_t word_size) {
+    std::fstream fs;
+    fs.open(zipname, std::ios::in | std::ios::out | std::ios::binary);
+    if (!fs.is_open()) {
+        throw std::runtime_error("npz_update: Unable to open file " + zipname);
+    }
+    uint16_t nrecs;
+    size_t global_header_size, global_header_offset;
+    parse_zip_footer(fs, nrecs, global_header_size, global_header_offset);
+    std::vector<ZipEntry> entries =
+        parse_global_header(fs, nrecs, global_header_size, global_header_offset);
+    // with duplicate names the last record is the live one, matching npz_load
+    auto found = entries.end();
+    for (auto iter = entries.begin(); iter != entries.end(); ++iter) {
+        if (iter->var_name == varname) {
+            found = iter;
+        }
+    }
+    if (found == entries.end()) {
+        throw std::runtime_error("npz_update: Variable name " + varname + " not found in " +
+                                 zipname);
+    }
+
+    std::string npy_header = create_npy_header(shape, type_class, word_size);
+    size_t nels = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<size_t>());
+    size_t nbytes = nels * word_size + npy_header.size();
+    uint32_t crc = crc32(0L, &npy_header[0], npy_header.size());
+    crc = crc32(crc, data, nels * word_size);
+
+    if (found->compr_method == 0 && found->uncompr_bytes == nbytes) {
+        // same payload size: if the dtype and header size also match, overwrite in place
+        fs.seekg(found->local_header_offset, std::ios::beg);
+        uint16_t compr_method = 0;
+        uint32_t compr_bytes = 0, uncompr_bytes = 0;
+        parse_local_header(fs, compr_method, compr_bytes, uncompr_bytes);
+        std::streamoff data_offset = fs.tellg();
+        size_t old_word_size;
+        std::vector<size_t> old_shape;
+        char old_type_class;
+        bool old_fortran_order;
+        parse_npy_header(fs, old_word_size, old_shape, old_type_class, old_fortran_order);
+        size_t old_header_size = (size_t)(fs.tellg() - data_offset);
+
+        if (old_type_class == type_class && old_word_size == word_size &&
+            old_header_size == npy_header.size()) {
+            std::string old_header(old_header_size, ' ');
+            fs.seekg(data_offset, std::ios::beg);
+            fs.read(&old_header[0], old_header_size);
+            fs.seekp(data_offset, std::ios::beg);
+            if (old_header != npy_header) {
+                fs.write(&npy_header[0], npy_header.size());
+            } else {
+                fs.seekp(npy_header.size(), std::ios::cur);
+            }
+            fs.write(data, nels * word_size);
+            // patch the crc in the local header and in the central directory record
+            fs.seekp(found->local_header_offset + 14, std::ios::beg);
+            fs.write((char*)&crc, 4);
+            fs.seekp(found->global_header_offset + 16, std::ios::beg);
+            fs.write((char*)&crc, 4);
+            fs.close();
+            return;
+        }
+    }
+
+    // otherwise write the new member over the old central directory and follow it with a
+    // directory that no longer references the old member. npz_compact reclaims its space.
+    // the new member keeps whatever payload alignment the retired one was saved with
+    std::vector<char> old_local_header(30);
+    fs.seekg(found->local_header_offset, std::ios::beg);
+    fs.read(&old_local_header[0], 30);
+    uint16_t old_name_len = *(uint16_t*)&old_local_header[26];
+    uint16_t old_extra_field_len = *(uint16_t*)&old_local_header[28];
+    std::vector<char> old_extra(old_extra_field_len + 1);
+    fs.seekg(old_name_len, std::ios::cur);
+    fs.read(&old_extra[0], old_extra_field_len);
+    uint16_t alignment = found->compr_method == 0
+                             ? padding_alignment(&old_extra[0], old_extra_field_len)
+                             : 0;
+
+    std::string fname = varname + ".npy";
+    uint16_t padding =
+        npz_payload_padding(global_header_offset, fname.size(), npy_header.size(), alignment);
+    auto local_header = create_local_header(fname, crc, nbytes, nbytes, 0, padding, alignment);
+    std::string global_header;
+    uint16_t new_nrecs = 0;
+    for (const ZipEntry& entry : entries) {
+        if (entry.var_name != varname) {
+            global_header += entry.global_header;
+            ++new_nrecs;
+        }
+    }
+    global_header += create_global_header(fname, local_header, global_header_offset);
+    ++new_nrecs;
+    size_t new_global_header_offset = global_header_offset + local_header.size() + nbytes;
+    auto footer = create_footer(new_nrecs, global_header.size(), new_global_header_offset);
+    fs.seekp(global_header_offset, std::ios::beg);
+    fs.write(&local_header[0], local_header.size());
+    fs.write(&npy_header[0], npy_header.size());
+    fs.write(data, nels * word_size);
+    fs.write(&global_header[0], global_header.size());
+    fs.write(&footer[0], footer.size());
+    fs.close();
+}
+
+void npz_update(std::string zipname, std::string varname, const NpyArray& array) {
+    npz_update(zipname, varname, array.data<char>(), array.shape, array.type_class,
+               array.word_size);
+}
+
+void npz_compact(const std::string& zipname) {
+    std::ifstream ifs;
+    ifs.open(zipname, std::ios::binary | std::ios::in);
+    if (!ifs.is_open()) {
+        throw std::runtime_error("npz_compact: Unable to open file " + zipname);
+    }
+    std::vector<ZipEntry> entries = read_zip_entries(ifs);
+    // older duplicates left by npz_save(..., "a") are dead too: keep only the last record of
+    // each name, which is the one npz_load returns
+    std::map<std::string, size_t> last_record;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        last_record[entries[i].var_name] = i;
+    }
+    std::vector<ZipEntry> live;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (last_record[entries[i].var_name] == i) {
+            live.push_back(entries[i]);
+        }
+    }
+    entries.swap(live);
+
+    std::string tmpname = zipname + ".tmp";
+    std::ofstream ofs;
+    ofs.open(tmpname, std::ios::binary | std::ios::out);
+    if (!ofs.is_open()) {
+        throw std::runtime_error("npz_compact: Cannot open " + tmpname + " for writing");
+    }
+    // copy every live member back to back and rebuild the directory with the new offsets
+    uint32_t offset = 0;
+    std::string global_header;
+    for (const ZipEntry& entry : entries) {
+        std::vector<char> local_header(30);
+        ifs.seekg(entry.local_header_offset, std::ios::beg);
+        ifs.read(&local_header[0], 30);
+        uint16_t name_len = *(uint16_t*)&local_header[26];
+        uint16_t extra_field_len = *(uint16_t*)&local_header[28];
+        std::string name_extra(name_len + extra_field_len, '\0');
+        ifs.read(&name_extra[0], name_extra.size());
+
+        // a stored member padded by npz_save is re-padded for its new offset so it keeps its
+        // alignment; any other extra field is copied as is
+        uint16_t alignment = padding_alignment(&name_extra[name_len], extra_field_len);
+        if (entry.compr_method == 0 && alignment > 1) {
+            std::vector<char> npy_start(12);
+            std::streampos data_start = ifs.tellg();
+            ifs.read(&npy_start[0], npy_start.size());
+            ifs.clear();
+            ifs.seekg(data_start);
+            size_t npy_header_len = npy_header_length(&npy_start[0], ifs.gcount());
+            extra_field_len = npz_payload_padding(offset, name_len, npy_header_len, alignment);
+            memcpy(&local_header[28], &extra_field_len, 2);
+            name_extra.resize(name_len);
+            if (extra_field_len > 0) {
+                name_extra += padding_record(extra_field_len, alignment);
+            }
+        }
+        size_t member_size = name_extra.size() + entry.compr_bytes;
+        ofs.write(&local_header[0], 30);
+        ofs.write(&name_extra[0], name_extra.size());
+        copy_stream_bytes(ifs, ofs, entry.compr_bytes);
+
+        std::string cur_global_header = entry.global_header;
+        memcpy(&cur_global_header[42], &offset, 4);
+        global_header += cur_global_header;
+        offset += 30 + member_size;
+    }
+    auto footer = create_footer(entries.size(), global_header.size(), offset);
+    ofs.write(&global_header[0], global_header.size());
+    ofs.write(&footer[0], footer.size());
+    ofs.close();
+    ifs.close();
+    if (!ofs) {
+        throw std::runtime_error("npz_compact: failed writing " + tmpname);
+    }
+    if (std::rename(tmpname.c_str(), zipname.c_str()) != 0) {
+        throw std::runtime_error("npz_compact: Unable to replace " + zipname);
+    }
+}
+
+NpzDatasetIterator::NpzDatasetIterator(const std::vector<std::string>& _files,
+                                       const std::vector<std::string>& _varnames,
+                                       size_t _batch_size, size_t _prefetch, size_t num_threads,
+                                       bool shuffle_shards, bool _shuffle_records,
+                                       unsigned int seed)
+    : files(_files),
+      varnames(_varnames),
+      batch_size(_batch_size),
+      prefetch(std::max<size_t>(_prefetch, 1)),
+      shuffle_records(_shuffle_records),
+      rng(seed),
+      order(_files.size()),
+      next_to_load(0),
+      next_to_consume(0),
+      stop(false),
+      num_records(0),
+      record_pos(0) {
+    std::iota(order.begin(), order.end(), 0);
+    if (shuffle_shards) {
+        std::shuffle(order.begin(), order.end(), rng);
+    }
+    num_threads = std::max<size_t>(std::min(num_threads, prefetch), 1);
+    for (size_t i = 0; i < num_threads; ++i) {
+        threads.emplace_back(&NpzDatasetIterator::worker, this);
+    }
+}
+
+NpzDatasetIterator::~NpzDatasetIterator() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void NpzDatasetIterator::worker() {
+    while (1) {
+        size_t seq;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            // backpressure: never hold more than `prefetch` shards the consumer hasn't taken
+            cv.wait(lock, [this] {
+                return stop || next_to_load >= order.size() ||
+                       next_to_load < next_to_consume + prefetch;
+            });
+            if (stop || next_to_load >= order.size()) {
+                return;
+            }
+            seq = next_to_load++;
+        }
+        npz_t arrays;
+        std::exception_ptr error;
+        try {
+            arrays = load_shard(files[order[seq]]);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready[seq] = std::make_pair(std::move(arrays), error);
+        }
+        cv.notify_all();
+    }
+}
+
+npz_t NpzDatasetIterator::load_shard(const std::string& fname) {
+    npz_t arrays;
+    if (fname.size() >= 4 && fname.compare(fname.size() - 4, 4, ".npy") == 0) {
+        arrays[varnames.empty() ? "arr_0" : varnames[0]] = npy_load(fname);
+    } else {
+        std::ifstream ifs;
+        ifs.open(fname, std::ios::binary | std::ios::in);
+        if (!ifs.is_open()) {
+            throw std::runtime_error("NpzDatasetIterator: Unable to open file " + fname);
+        }
+        for (const ZipEntry& entry : read_zip_entries(ifs)) {
+            if (varnames.empty() ||
+                std::find(varnames.begin(), varnames.end(), entry.var_name) != varnames.end()) {
+                arrays[entry.var_name] = load_the_npz_member(ifs, entry);
+            }
+        }
+        ifs.close();
+        for (const std::string& varname : varnames) {
+            if (arrays.find(varname) == arrays.end()) {
+                throw std::runtime_error("NpzDatasetIterator: Variable name " + varname +
+                                         " not found in " + fname);
+            }
+        }
+    }
+    if (batch_size > 0) {
+        // batches are cut as contiguous runs of rows, which only holds for C order arrays
+        for (auto iter = arrays.begin(); iter != arrays.end(); ++iter) {
+            if (iter->second.fortran_order || iter->second.shape.empty()) {
+                throw std::runtime_error("NpzDatasetIterator: can't batch " + iter->first +
+                                         " in " + fname +
+                                         ", only C order arrays with at least one axis");
+            }
+        }
+    }
+    return arrays;
+}
+
+bool NpzDatasetIterator::next_shard() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (next_to_consume >= order.size()) {
+        return false;
+    }
+    cv.wait(lock, [this] { return ready.count(next_to_consume) > 0; });
+    auto iter = ready.find(next_to_consume);
+    std::exception_ptr error = iter->second.second;
+    npz_t arrays = std::move(iter->second.first);
+    ready.erase(iter);
+    ++next_to_consume;
+    lock.unlock();
+    cv.notify_all();
+
+    // drop the finished shard first, so a bad one leaves nothing to cut batches from and the
+    // caller can catch the error and move on to the next shard
+    shard.clear();
+    num_records = 0;
+    record_pos = 0;
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    size_t rows = 0;
+    for (auto iter = arrays.begin(); iter != arrays.end(); ++iter) {
+        size_t cur_rows = iter->second.shape.empty() ? 1 : iter->second.shape[0];
+        if (iter != arrays.begin() && cur_rows != rows) {
+            throw std::runtime_error("NpzDatasetIterator: members of a shard differ in length");
+        }
+        rows = cur_rows;
+    }
+    shard = std::move(arrays);
+    num_records = rows;
+    records.resize(num_records);
+    std::iota(records.begin(), records.end(), 0);
+    if (shuffle_records) {
+        std::shuffle(records.begin(), records.end(), rng);
+    }
+    return true;
+}
+
+bool NpzDatasetIterator::next(npz_t& batch) {
+    while (record_pos >= num_records || shard.empty()) {
+        if (!next_shard()) {
+            return false;
+        }
+        if (batch_size == 0 && !shard.empty()) {
+            batch = std::move(shard);
+            shard.clear();
+            return true;
+        }
+    }
+    size_t count = std::min(batch_size, num_records - record_pos);
+    batch.clear();
+    for (auto iter = shard.begin(); iter != shard.end(); ++iter) {
+        const NpyArray& src = iter->second;
+        size_t row_bytes = num_records ? src.num_bytes() / num_records : 0;
+        NpyArray dst;
+        if (shuffle_records) {
+            std::vector<size_t> shape = src.shape;
+            shape[0] = count;
+            dst = NpyArray(shape, src.word_size, src.fortran_order, src.type_class);
+            for (size_t i = 0; i < count; ++i) {
+                memcpy(dst.data<char>() + i * row_bytes,
+                       src.data<char>() + records[record_pos + i] * row_bytes, row_bytes);
+            }
+        } else {
+            // contiguous rows: alias the shard's buffer instead of copying
+            dst = src;
+            if (!dst.shape.empty()) {
+                dst.shape[0] = count;
+            }
+            dst.num_vals = count * row_bytes / std::max<size_t>(src.word_size, 1);
+            dst.offset = src.offset + record_pos * row_bytes;
+        }
+        batch[iter->first] = dst;
+    }
+    record_pos += count;
+    return true;
+}
+
+#if defined(__linux__) && defined(O_DIRECT)
+// O_DIRECT needs the buffer, file offset and length aligned to the logical block size.
+// 4096 covers every common device; the bounce buffer holds unaligned heads and tails.
+const size_t direct_block = 4096;
+const size_t direct_chunk = 8 << 20;
+
+struct DirectFile {
+    DirectFile(int _fd) : fd(_fd), bounce(nullptr) {
+        if (posix_memalign(&bounce, direct_block, direct_chunk) != 0) {
+            bounce = nullptr;
+        }
+    }
+    ~DirectFile() {
+        free(bounce);
+        if (fd >= 0) close(fd);
+    }
+    int fd;
+    void* bounce;
+};
+
+void pwrite_all(int fd, const char* buf, size_t nbytes, off_t offset) {
+    while (nbytes > 0) {
+        ssize_t n = pwrite(fd, buf, std::min<size_t>(nbytes, 1 << 30), offset);
+        if (n <= 0) {
+            throw std::runtime_error("npy_save: direct write failed");
+        }
+        buf += n;
+        nbytes -= n;
+        offset += n;
+    }
+}
+
+// fills buf from offset, returning fewer than nbytes only at end of file
+size_t pread_all(int fd, char* buf, size_t nbytes, off_t offset) {
+    size_t total = 0;
+    while (total < nbytes) {
+        ssize_t n = pread(fd, buf + total, std::min<size_t>(nbytes - total, 1 << 30),
+                          offset + total);
+        if (n < 0) {
+            throw std::runtime_error("npy_load: direct read failed");
+        }
+        if (n == 0) break;
+        total += n;
+    }
+    return total;
+}
+#endif
+
+bool npy_write_direct(const std::string& fname, const std::string& header, const char* data,
+                      size_t nbytes) {
+#if defined(__linux__) && defined(O_DIRECT)
+    if (header.size() % direct_block != 0) {
+        return false;
+    }
+    DirectFile file(open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644));
+    if (file.fd < 0 || !file.bounce) {
+        // e.g. EINVAL on filesystems without O_DIRECT support
+        return false;
+    }
+    char* bounce = (char*)file.bounce;
+    off_t offset = 0;
+    memcpy(bounce, &header[0], header.size());
+    pwrite_all(file.fd, bounce, header.size(), offset);
+    offset += header.size();
+
+    // whole blocks go straight from the caller's buffer when it is aligned, else via bounce
+    size_t body = nbytes / direct_block * direct_block;
+    if ((uintptr_t)data % direct_block == 0) {
+        pwrite_all(file.fd, data, body, offset);
+    } else {
+        for (size_t done = 0; done < body; done += direct_chunk) {
+            size_t chunk = std::min(direct_chunk, body - done);
+            memcpy(bounce, data + done, chunk);
+            pwrite_all(file.fd, bounce, chunk, offset + done);
+        }
+    }
+    offset += body;
+
+    // the tail is padded to a whole block, then the file is cut back to its real length
+    size_t tail = nbytes - body;
+    if (tail > 0) {
+        memset(bounce, 0, direct_block);
+        memcpy(bounce, data + body, tail);
+        pwrite_all(file.fd, bounce, direct_block, offset);
+        if (ftruncate(file.fd, offset + tail) != 0) {
+            throw std::runtime_error("npy_save: Unable to truncate " + fname);
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// reads an npy file with O_DIRECT. open() returns false where O_DIRECT is unavailable;
+// otherwise parse_header() and read_payload() stream the file through the aligned bounce
+// buffer, so the payload lands in the caller's buffer without an intermediate array
+class DirectNpyReader {
+   public:
+    DirectNpyReader() : got(0), pos(0), offset(0) {}
+
+    bool open(const std::string& _fname) {
+        fname = _fname;
+#if defined(__linux__) && defined(O_DIRECT)
+        file.reset(new DirectFile(::open(fname.c_str(), O_RDONLY | O_DIRECT)));
+        if (file->fd < 0 || !file->bounce) {
+            file.reset();
+            return false;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void parse_header(size_t& word_size, std::vector<size_t>& shape, char& type_class,
+                      bool& fortran_order) {
+        fill();
+        size_t header_len = npy_header_length(bounce(), got);
+        if (header_len == 0 || header_len > got) {
+            throw std::runtime_error("npy_load: corrupt npy header in " + fname);
+        }
+        std::istringstream iss(std::string(bounce(), header_len));
+        parse_npy_header(iss, word_size, shape, type_class, fortran_order);
+        pos = header_len;
+    }
+
+    void read_payload(char* dst, size_t nbytes) {
+        while (nbytes > 0) {
+            if (pos == got) {
+                fill();
+                if (got == 0) {
+                    throw std::runtime_error("npy_load: unexpected end of file " + fname);
+                }
+            }
+            size_t chunk = std::min(nbytes, got - pos);
+            memcpy(dst, bounce() + pos, chunk);
+            dst += chunk;
+            nbytes -= chunk;
+            pos += chunk;
+        }
+    }
+
+   private:
+    // reads the next bounce-buffer-sized, block aligned piece of the file
+    void fill() {
+#if defined(__linux__) && defined(O_DIRECT)
+        got = pread_all(file->fd, bounce(), direct_chunk, offset);
+        offset += got;
+        pos = 0;
+#endif
+    }
+
+#if defined(__linux__) && defined(O_DIRECT)
+    char* bounce() { return (char*)file->bounce; }
+    std::unique_ptr<DirectFile> file;
+#else
+    char* bounce() { return nullptr; }
+#endif
+    std::string fname;
+    size_t got;     // valid bytes in the bounce buffer
+    size_t pos;     // bytes of those already consumed
+    size_t offset;  // file offset of the next fill
+};
+
+NpyArray npy_load_direct(const std::string& fname, bool& loaded) {
+    DirectNpyReader reader;
+    loaded = reader.open(fname);
+    if (!loaded) {
+        return NpyArray();
+    }
+    std::vector<size_t> shape{};
+    size_t word_size;
+    bool fortran_order;
+    char type_class;
+    reader.parse_header(word_size, shape, type_class, fortran_order);
+    NpyArray arr(shape, word_size, fortran_order, type_class);
+    reader.read_payload(arr.data<char>(), arr.num_bytes());
+    return arr;
+}
+
+NpyArray npy_load(const std::string& fname, bool direct_io) {
+    if (direct_io) {
+        bool loaded;
+        NpyArray arr = npy_load_direct(fname, loaded);
+        if (loaded) {
+            return arr;
+        }
+    }
     std::ifstream ifs;
     ifs.open(fname, std::ios::binary | std::ios::in);
     if (!ifs.is_open()) {
@@ -270,7 +1077,272 @@ NpyArray npy_load(const std::string& fname) {
     return arr;
 }
 
-std::string create_npy_header(const std::vector<size_t>& shape, char type_class, size_t word_size) {
+// runs fn(0) .. fn(n - 1) on up to num_threads threads (0 for one per hardware thread),
+// rethrowing the first failure
+void parallel_for(size_t n, size_t num_threads, const std::function<void(size_t)>& fn) {
+    std::atomic<size_t> next(0);
+    std::vector<std::exception_ptr> errors(n);
+    auto worker = [&]() {
+        for (size_t i = next++; i < n; i = next++) {
+            try {
+                fn(i);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+    if (num_threads == 0) {
+        num_threads = std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+    }
+    num_threads = std::max<size_t>(std::min(num_threads, n), 1);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+std::string shard_dir(const std::string& prefix) {
+    size_t slash = prefix.find_last_of('/');
+    return slash == std::string::npos ? "" : prefix.substr(0, slash + 1);
+}
+
+// shard files are always named after the prefix, so any prefix, spaces included, round trips
+std::string shard_name(const std::string& prefix, size_t i) {
+    return prefix + ".shard" + std::to_string(i) + ".npy";
+}
+
+// flushes a file, or a directory's entries, to stable storage where the platform allows it
+void sync_path(const std::string& path) {
+#if defined(__linux__)
+    int fd = open(path.empty() ? "." : path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("sync_path: Unable to open " + path);
+    }
+    int ret = fsync(fd);
+    close(fd);
+    if (ret != 0) {
+        throw std::runtime_error("sync_path: fsync failed on " + path);
+    }
+#endif
+}
+
+void npy_save_sharded(const std::string& prefix, const char* data,
+                      const std::vector<size_t>& shape, char type_class, size_t word_size,
+                      size_t nshards, size_t num_threads, const SavePolicy& policy) {
+    if (shape.empty()) {
+        throw std::runtime_error("npy_save_sharded: cannot shard a 0-d array");
+    }
+    size_t rows = shape[0];
+    size_t row_bytes = std::accumulate(shape.begin() + 1, shape.end(), word_size,
+                                       std::multiplies<size_t>());
+    nshards = std::max<size_t>(std::min(nshards, rows), 1);
+
+    // retire any manifest from an earlier save before its shards get overwritten, so a crash
+    // part way through leaves no manifest at all rather than one describing torn shards.
+    // shards past the new count would never be overwritten, so they are deleted as well.
+    std::string mname = prefix + ".manifest";
+    size_t old_nshards = 0;
+    std::ifstream old_manifest;
+    old_manifest.open(mname, std::ios::in);
+    std::string line;
+    while (std::getline(old_manifest, line)) {
+        std::istringstream ls(line);
+        std::string key;
+        if (ls >> key && key == "shards") {
+            ls >> old_nshards;
+        }
+    }
+    old_manifest.close();
+    if (std::remove(mname.c_str()) == 0) {
+        sync_path(shard_dir(prefix));
+    }
+    for (size_t i = nshards; i < old_nshards; ++i) {
+        std::remove(shard_name(prefix, i).c_str());
+    }
+
+    std::vector<size_t> shard_rows(nshards);
+    std::vector<uint32_t> shard_crcs(nshards);
+    parallel_for(nshards, num_threads, [&](size_t i) {
+        size_t begin = rows * i / nshards;
+        size_t end = rows * (i + 1) / nshards;
+        std::vector<size_t> cur_shape = shape;
+        cur_shape[0] = end - begin;
+        const char* cur_data = data + begin * row_bytes;
+        size_t nbytes = (end - begin) * row_bytes;
+        std::string fname = shard_name(prefix, i);
+
+        size_t alignment = policy.direct_io ? std::max<size_t>(policy.alignment, 4096)
+                                            : policy.alignment;
+        std::string header = create_npy_header(cur_shape, type_class, word_size, alignment);
+        if (!policy.direct_io || !npy_write_direct(fname, header, cur_data, nbytes)) {
+            std::ofstream ofs;
+            ofs.open(fname, std::ios::binary | std::ios::out);
+            if (!ofs.is_open()) {
+                throw std::runtime_error("npy_save_sharded: Cannot open " + fname +
+                                         " for writing");
+            }
+            ofs.write(&header[0], header.size());
+            ofs.write(cur_data, nbytes);
+            ofs.close();
+            if (!ofs) {
+                throw std::runtime_error("npy_save_sharded: failed writing " + fname);
+            }
+        }
+        sync_path(fname);
+        shard_rows[i] = end - begin;
+        shard_crcs[i] = crc32(0L, cur_data, nbytes);
+    });
+
+    // the manifest goes last: only once every shard is synced is it written, synced and
+    // renamed into place, so whenever a manifest exists its shards are complete
+    std::stringstream manifest;
+    manifest << "cnpy_sharded 1\n";
+    manifest << "descr " << big_endian_test() << type_class << word_size << "\n";
+    manifest << "shape";
+    for (size_t dim : shape) {
+        manifest << " " << dim;
+    }
+    manifest << "\nshards " << nshards << "\n";
+    for (size_t i = 0; i < nshards; ++i) {
+        manifest << "shard " << shard_rows[i] << " " << std::hex << std::setw(8)
+                 << std::setfill('0') << shard_crcs[i] << std::dec << "\n";
+    }
+    std::string tmpname = mname + ".tmp";
+    std::ofstream ofs;
+    ofs.open(tmpname, std::ios::out);
+    if (!ofs.is_open()) {
+        throw std::runtime_error("npy_save_sharded: Cannot open " + tmpname + " for writing");
+    }
+    ofs << manifest.str();
+    ofs.close();
+    if (!ofs) {
+        throw std::runtime_error("npy_save_sharded: failed writing " + tmpname);
+    }
+    sync_path(tmpname);
+    if (std::rename(tmpname.c_str(), mname.c_str()) != 0) {
+        throw std::runtime_error("npy_save_sharded: failed writing " + mname);
+    }
+    sync_path(shard_dir(prefix));
+}
+
+NpyArray npy_load_sharded(const std::string& prefix, std::vector<NpyArray>* shard_views,
+                          size_t num_threads, bool direct_io) {
+    std::string mname = prefix + ".manifest";
+    std::ifstream ifs;
+    ifs.open(mname, std::ios::in);
+    if (!ifs.is_open()) {
+        throw std::runtime_error("npy_load_sharded: Unable to open file " + mname);
+    }
+    std::string line, key, descr;
+    std::vector<size_t> shape;
+    std::vector<size_t> shard_rows;
+    std::vector<uint32_t> shard_crcs;
+    size_t nshards = 0;
+    while (std::getline(ifs, line)) {
+        std::istringstream ls(line);
+        ls >> key;
+        if (key == "descr") {
+            ls >> descr;
+        } else if (key == "shape") {
+            size_t dim;
+            while (ls >> dim) shape.push_back(dim);
+        } else if (key == "shards") {
+            ls >> nshards;
+        } else if (key == "shard") {
+            size_t rows;
+            uint32_t crc;
+            ls >> rows >> std::hex >> crc >> std::dec;
+            shard_rows.push_back(rows);
+            shard_crcs.push_back(crc);
+        }
+    }
+    ifs.close();
+    if (descr.size() < 3 || shape.empty() || nshards == 0 || shard_rows.size() != nshards) {
+        throw std::runtime_error("npy_load_sharded: corrupt manifest " + mname);
+    }
+    if (descr[0] != '<' && descr[0] != '|') {
+        throw std::runtime_error("npy_load_sharded: big endian data in " + mname);
+    }
+    char type_class = descr[1];
+    size_t word_size = atoi(descr.substr(2).c_str());
+    if (word_size == 0) {
+        throw std::runtime_error("npy_load_sharded: corrupt manifest " + mname);
+    }
+    size_t row_bytes = std::accumulate(shape.begin() + 1, shape.end(), word_size,
+                                       std::multiplies<size_t>());
+
+    // every shard is read straight into its slice of one preallocated array
+    NpyArray arr(shape, word_size, false, type_class);
+    std::vector<size_t> shard_begin(nshards + 1, 0);
+    for (size_t i = 0; i < nshards; ++i) {
+        shard_begin[i + 1] = shard_begin[i] + shard_rows[i];
+    }
+    if (shard_begin[nshards] != shape[0]) {
+        throw std::runtime_error("npy_load_sharded: shard rows don't add up in " + mname);
+    }
+    parallel_for(nshards, num_threads, [&](size_t i) {
+        std::string fname = shard_name(prefix, i);
+        char* dst = arr.data<char>() + shard_begin[i] * row_bytes;
+        size_t nbytes = shard_rows[i] * row_bytes;
+        std::vector<size_t> cur_shape;
+        size_t cur_word_size;
+        char cur_type_class;
+        bool cur_fortran_order;
+        // both paths read the payload straight into this shard's slice of arr
+        DirectNpyReader reader;
+        bool direct = direct_io && reader.open(fname);
+        std::ifstream sfs;
+        if (direct) {
+            reader.parse_header(cur_word_size, cur_shape, cur_type_class, cur_fortran_order);
+        } else {
+            sfs.open(fname, std::ios::binary | std::ios::in);
+            if (!sfs.is_open()) {
+                throw std::runtime_error("npy_load_sharded: Unable to open file " + fname);
+            }
+            parse_npy_header(sfs, cur_word_size, cur_shape, cur_type_class, cur_fortran_order);
+        }
+        if (cur_type_class != type_class || cur_word_size != word_size || cur_fortran_order ||
+            cur_shape.size() != shape.size() || cur_shape[0] != shard_rows[i] ||
+            !std::equal(shape.begin() + 1, shape.end(), cur_shape.begin() + 1)) {
+            throw std::runtime_error("npy_load_sharded: " + fname + " doesn't match the manifest");
+        }
+        if (direct) {
+            reader.read_payload(dst, nbytes);
+        } else {
+            sfs.read(dst, nbytes);
+            if (!sfs) {
+                throw std::runtime_error("npy_load_sharded: unexpected end of file " + fname);
+            }
+        }
+        if (crc32(0L, dst, nbytes) != shard_crcs[i]) {
+            throw std::runtime_error("npy_load_sharded: checksum mismatch in " + fname);
+        }
+    });
+
+    if (shard_views) {
+        shard_views->clear();
+        for (size_t i = 0; i < nshards; ++i) {
+            NpyArray view = arr;
+            view.shape[0] = shard_rows[i];
+            view.num_vals = shard_rows[i] * row_bytes / word_size;
+            view.offset = shard_begin[i] * row_bytes;
+            shard_views->push_back(view);
+        }
+    }
+    return arr;
+}
+
+std::string create_npy_header(const std::vector<size_t>& shape, char type_class, size_t word_size,
+                              size_t alignment) {
     std::string dict;
     dict += "{'descr': '";
     dict += big_endian_test();
@@ -286,7 +1358,14 @@ std::string create_npy_header(const std::vector<size_t>& shape, char type_class,
         dict += ",";
     }
     dict += "), }";
-    int remainder = 16 - (10 + dict.size()) % 16;
+    // pad with spaces so the payload starts on an `alignment` boundary
+    if (alignment == 0) {
+        alignment = 16;
+    }
+    if (10 + dict.size() + alignment > 0xffff) {
+        throw std::runtime_error("create_npy_header: alignment too large");
+    }
+    size_t remainder = alignment - (10 + dict.size()) % alignment;
     std::string remainder_str(remainder - 1, ' ');
     dict += remainder_str;
     dict += "\n";
@@ -300,13 +1379,37 @@ std::string create_npy_header(const std::vector<size_t>& shape, char type_class,
 }
 
 std::string create_local_header(std::string& varname, uint32_t crc, uint32_t nbytes) {
+    return create_local_header(varname, crc, nbytes, nbytes, 0);
+}
+
+uint16_t npz_payload_padding(size_t offset, size_t name_len, size_t npy_header_len,
+                             size_t alignment) {
+    if (alignment <= 1) {
+        return 0;
+    }
+    // the padding record needs its 4 byte id/size header plus the 2 byte alignment
+    size_t payload_offset = offset + 30 + name_len + npy_header_len;
+    size_t padding = (alignment - payload_offset % alignment) % alignment;
+    while (padding > 0 && padding < 6) {
+        padding += alignment;
+    }
+    if (alignment > 0xffff || padding > 0xffff) {
+        throw std::runtime_error("npz_save: alignment too large");
+    }
+    return (uint16_t)padding;
+}
+
+std::string create_local_header(std::string& varname, uint32_t crc, uint32_t nbytes,
+                                uint32_t compr_bytes, uint16_t compress_method,
+                                uint16_t extra_length, uint16_t alignment) {
     const uint16_t local_sig = 0x0403;   // second part of sig
     const uint16_t min_version = 20;     // min version to extract
     const uint16_t bit_flag = 0;         // general purpose bit flag
-    const uint16_t compress_method = 0;  // compression method
     const uint16_t last_mod_time = 0;    // file last mod time
     const uint16_t last_mod_date = 0;    // file last mod date
-    const uint16_t extra_length = 0;     // exta field length
+    if (extra_length > 0 && extra_length < 6) {
+        throw std::runtime_error("create_local_header: extra field shorter than its header");
+    }
     uint16_t var_name_size = (uint16_t)varname.size();
     std::stringstream ss;
     ss << "PK";
@@ -317,17 +1420,21 @@ std::string create_local_header(std::string& varname, uint32_t crc, uint32_t nby
     ss.write((char*)&last_mod_time, 2);
     ss.write((char*)&last_mod_date, 2);
     ss.write((char*)&crc, 4);
-    ss.write((char*)&nbytes, 4);  // compr bytes
-    ss.write((char*)&nbytes, 4);  // uncompr bytes
+    ss.write((char*)&compr_bytes, 4);  // compr bytes
+    ss.write((char*)&nbytes, 4);       // uncompr bytes
     ss.write((char*)&var_name_size, 2);
     ss.write((char*)&extra_length, 2);
     ss << varname;
+    if (extra_length > 0) {
+        ss << padding_record(extra_length, alignment);
+    }
     return ss.str();
 }
 
 std::string create_global_header(std::string& varname, std::string& local, uint32_t offset) {
     const uint16_t global_sig = 0x0201;  // second part of sig
     const uint16_t min_version = 20;     // version made by
+    const uint16_t extra_len = 0;        // extra field length
     const uint16_t comment_len = 0;      // file comment length
     const uint16_t disk_num = 0;         // disk number where file starts
     const uint16_t inter_file_attr = 0;  // internal file attributes
@@ -336,7 +1443,8 @@ std::string create_global_header(std::string& varname, std::string& local, uint3
     ss << "PK";
     ss.write((char*)&global_sig, 2);
     ss.write((char*)&min_version, 2);
-    ss.write(&local[4], 26);
+    ss.write(&local[4], 24);
+    ss.write((char*)&extra_len, 2);  // local padding isn't repeated here
     ss.write((char*)&comment_len, 2);
     ss.write((char*)&disk_num, 2);
     ss.write((char*)&inter_file_attr, 2);
@@ -364,7 +1472,7 @@ std::string create_footer(uint16_t nrecs, uint32_t gh_size, uint32_t gh_offset)
     return ss.str();
 }
 
-std::string npz_save_buffer(const npz_t& arrays) {
+std::string npz_save_buffer(const npz_t& arrays, const SavePolicy& policy, save_stats_t* stats) {
     std::stringstream ss;
     size_t global_header_offset = 0;
     std::string global_header;
@@ -387,16 +1495,31 @@ std::string npz_save_buffer(const npz_t& arrays) {
         uint32_t crc = crc32(0L, &npy_header[0], npy_header.size());
         crc = crc32(crc, (uint8_t*)data, nels * word_size);
 
-        // build the local header
-        auto local_header = create_local_header(var_name, crc, nbytes);
+        // decide how to store the member; deflated members come back in compressed
+        std::string compressed;
+        uint16_t compr_method = compress_member(var_name, npy_header, data, nels * word_size,
+                                                policy, compressed, stats);
+        size_t compr_bytes = compr_method ? compressed.size() : nbytes;
+
+        // build the local header, padded so a stored payload lands on policy.alignment
+        uint16_t padding = compr_method ? 0
+                                        : npz_payload_padding(global_header_offset, var_name.size(),
+                                                              npy_header.size(), policy.alignment);
+        auto local_header =
+            create_local_header(var_name, crc, nbytes, compr_bytes, compr_method, padding,
+                                (uint16_t)policy.alignment);
         // build global header
         auto cur_global_header = create_global_header(var_name, local_header, global_header_offset);
         global_header += cur_global_header;
-        global_header_offset += (nbytes + local_header.size());
+        global_header_offset += (compr_bytes + local_header.size());
         // write everything
         ss.write(&local_header[0], sizeof(char) * local_header.size());
-        ss.write(&npy_header[0], sizeof(char) * npy_header.size());
-        ss.write(data, word_size * nels);
+        if (compr_method) {
+            ss.write(&compressed[0], sizeof(char) * compressed.size());
+        } else {
+            ss.write(&npy_header[0], sizeof(char) * npy_header.size());
+            ss.write(data, word_size * nels);
+        }
     }
     // build footer
     auto footer = create_footer(arrays.size(), global_header.size(), global_header_offset);
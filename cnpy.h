@@ -6,16 +6,22 @@
 #define LIBCNPY_H_
 
 #include <stdint.h>
+#include <algorithm>
 #include <cassert>
+#include <condition_variable>
 #include <cstdio>
+#include <exception>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <numeric>
+#include <random>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <typeinfo>
 #include <vector>
 
@@ -32,21 +38,23 @@ struct NpyArray {
         : shape(_shape),
           word_size(_word_size),
           fortran_order(_fortran_order),
-          type_class(_type_class) {
+          type_class(_type_class),
+          offset(0) {
         num_vals = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<size_t>());
         data_holder.reset(new std::vector<char>(num_vals * word_size));
     }
 
-    NpyArray() : shape(0), word_size(0), fortran_order(0), type_class('?'), num_vals(0) {}
+    NpyArray()
+        : shape(0), word_size(0), fortran_order(0), type_class('?'), num_vals(0), offset(0) {}
 
     template <typename T>
     T* data() {
-        return reinterpret_cast<T*>(&(*data_holder)[0]);
+        return reinterpret_cast<T*>(&(*data_holder)[offset]);
     }
 
     template <typename T>
     const T* data() const {
-        return reinterpret_cast<T*>(&(*data_holder)[0]);
+        return reinterpret_cast<T*>(&(*data_holder)[offset]);
     }
 
     template <typename T>
@@ -55,7 +63,7 @@ struct NpyArray {
         return std::vector<T>(p, p + num_vals);
     }
 
-    size_t num_bytes() const { return data_holder->size(); }
+    size_t num_bytes() const { return num_vals * word_size; }
 
     std::shared_ptr<std::vector<char>> data_holder;
     std::vector<size_t> shape;
@@ -63,10 +71,50 @@ struct NpyArray {
     bool fortran_order;
     char type_class;
     size_t num_vals;
+    size_t offset;  // byte offset into data_holder, non-zero for views of a larger array
 };
 
 using npz_t = std::map<std::string, NpyArray>;
 
+// how arrays are written. level 0 stores every npz member as-is, which is what numpy's
+// savez does. level 1-9 deflates members at that zlib level; with adaptive set, a sample of
+// each member is deflated first and the member is stored whenever deflate doesn't shrink the
+// sample below max_ratio, or deflated at level 1 when `level` gains less than min_level_gain.
+// alignment places stored payloads on that byte boundary (e.g. 64 for AVX-512, 4096 for
+// pages): npy pads its header, npz pads the local header's extra field. direct_io makes
+// npy_save bypass the page cache with O_DIRECT, padding the header to at least 4096.
+struct SavePolicy {
+    SavePolicy(int _level = 0, bool _adaptive = false, size_t _alignment = 0,
+               bool _direct_io = false)
+        : level(_level),
+          adaptive(_adaptive),
+          sample_bytes(64 * 1024),
+          max_ratio(0.9),
+          min_level_gain(0.02),
+          alignment(_alignment),
+          direct_io(_direct_io) {}
+
+    int level;              // highest zlib level to use, 0 to store
+    bool adaptive;          // decide per member from a sample
+    size_t sample_bytes;    // bytes sampled from each member
+    double max_ratio;       // largest compressed/raw sample ratio still worth deflating
+    double min_level_gain;  // ratio improvement needed to pay for `level` over level 1
+    size_t alignment;       // payload alignment in bytes, 0 for npy's default of 16
+    bool direct_io;         // npy_save only: write with O_DIRECT where supported
+};
+
+// what the writer chose for one member
+struct MemberStats {
+    std::string name;
+    uint16_t compr_method;  // 0 stored, 8 deflated
+    int level;              // zlib level used, 0 when stored
+    size_t uncompr_bytes;   // npy header + payload
+    size_t compr_bytes;     // bytes written to the archive
+    double ratio;           // compr_bytes / uncompr_bytes
+};
+
+using save_stats_t = std::vector<MemberStats>;
+
 uint32_t crc32(uint32_t crc, const void* data, size_t length);
 char map_type(const std::type_info& t);
 void parse_npy_header(std::istream& is, size_t& word_size, std::vector<size_t>& shape,
@@ -74,20 +122,117 @@ void parse_npy_header(std::istream& is, size_t& word_size, std::vector<size_t>&
 void parse_zip_footer(std::istream& is, uint16_t& nrecs, size_t& global_header_size,
                       size_t& global_header_offset);
 
-std::string create_npy_header(const std::vector<size_t>& shape, char type_class, size_t word_size);
+std::string create_npy_header(const std::vector<size_t>& shape, char type_class, size_t word_size,
+                              size_t alignment = 16);
 std::string create_local_header(std::string& varname, uint32_t crc, uint32_t nbytes);
+std::string create_local_header(std::string& varname, uint32_t crc, uint32_t nbytes,
+                                uint32_t compr_bytes, uint16_t compress_method,
+                                uint16_t extra_length = 0, uint16_t alignment = 0);
+uint16_t npz_payload_padding(size_t offset, size_t name_len, size_t npy_header_len,
+                             size_t alignment);
 std::string create_global_header(std::string& varname, std::string& local, uint32_t offset);
 std::string create_footer(uint16_t nrecs, uint32_t gh_size, uint32_t gh_offset);
 
-NpyArray npy_load(const std::string& fname);
+// direct_io reads with O_DIRECT where supported, falling back to buffered reads
+NpyArray npy_load(const std::string& fname, bool direct_io = false);
+
+// splits data along axis 0 into nshards plain .npy files, prefix.shard<i>.npy, written
+// concurrently on num_threads threads (0 for one per hardware thread, never more than one
+// per shard). prefix.manifest records the dtype, full shape, and rows and crc32 of every
+// shard. any old manifest is removed first, along with shards past the new count, and the
+// new one is only renamed into place after every shard is fsynced.
+void npy_save_sharded(const std::string& prefix, const char* data,
+                      const std::vector<size_t>& shape, char type_class, size_t word_size,
+                      size_t nshards, size_t num_threads = 0,
+                      const SavePolicy& policy = SavePolicy());
+// reads the shards named by prefix.manifest concurrently (num_threads as above) into one
+// array, verifying each checksum. shard_views, if given, receives one view per shard into
+// the returned array.
+NpyArray npy_load_sharded(const std::string& prefix,
+                          std::vector<NpyArray>* shard_views = nullptr, size_t num_threads = 0,
+                          bool direct_io = false);
 npz_t npz_load(const std::string& fname);
 NpyArray npz_load(const std::string& fname, const std::string& varname);
 npz_t npz_load_buffer(std::string& serilize_data);
-std::string npz_save_buffer(const npz_t& arrays);
+std::string npz_save_buffer(const npz_t& arrays, const SavePolicy& policy = SavePolicy(),
+                            save_stats_t* stats = nullptr);
+uint16_t compress_member(const std::string& fname, const std::string& npy_header,
+                         const char* data, size_t nbytes, const SavePolicy& policy,
+                         std::string& compressed, save_stats_t* stats);
+// writes header + data with O_DIRECT; false if unsupported here, nothing is written then
+bool npy_write_direct(const std::string& fname, const std::string& header, const char* data,
+                      size_t nbytes);
+
+// replace the member varname of an existing npz. a stored member with the same dtype and
+// byte size is overwritten in place; anything else is appended and the old member retired
+// from the central directory until npz_compact rewrites the archive without it.
+void npz_update(std::string zipname, std::string varname, const char* data,
+                const std::vector<size_t>& shape, char type_class, size_t word_size);
+void npz_update(std::string zipname, std::string varname, const NpyArray& array);
+void npz_compact(const std::string& zipname);
+
+// iterates over a list of .npz/.npy shards, loading up to `prefetch` shards ahead of the
+// consumer on `num_threads` background threads. with batch_size == 0 every call to next()
+// returns the selected members of one whole shard; otherwise it returns batches of
+// batch_size records (rows along axis 0) that never span two shards. unshuffled batches
+// are views sharing the shard's buffer; batching requires C order members with at least
+// one axis. a .npy shard yields one member named varnames[0], or "arr_0" when no names are
+// given.
+class NpzDatasetIterator {
+   public:
+    NpzDatasetIterator(const std::vector<std::string>& files,
+                       const std::vector<std::string>& varnames, size_t batch_size = 0,
+                       size_t prefetch = 2, size_t num_threads = 1, bool shuffle_shards = false,
+                       bool shuffle_records = false, unsigned int seed = 0);
+    ~NpzDatasetIterator();
+
+    NpzDatasetIterator(const NpzDatasetIterator&) = delete;
+    NpzDatasetIterator& operator=(const NpzDatasetIterator&) = delete;
+
+    // blocks until the next batch is available. returns false once every shard is consumed.
+    bool next(npz_t& batch);
+
+   private:
+    void worker();
+    npz_t load_shard(const std::string& fname);
+    bool next_shard();
+
+    std::vector<std::string> files;
+    std::vector<std::string> varnames;
+    size_t batch_size;
+    size_t prefetch;
+    bool shuffle_records;
+    std::mt19937 rng;
+
+    // shared with the workers, guarded by mutex
+    std::vector<size_t> order;  // shard visiting order
+    size_t next_to_load;
+    size_t next_to_consume;
+    std::map<size_t, std::pair<npz_t, std::exception_ptr>> ready;
+    bool stop;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::thread> threads;
+
+    // shard currently being cut into batches, owned by the consumer
+    npz_t shard;
+    std::vector<size_t> records;
+    size_t num_records;
+    size_t record_pos;
+};
 
 template <typename T>
 void npy_save(std::string fname, const T* data, const std::vector<size_t> shape,
-              std::string mode = "w") {
+              std::string mode = "w", const SavePolicy& policy = SavePolicy()) {
+    size_t alignment = policy.alignment;
+    if (policy.direct_io && mode != "a") {
+        alignment = std::max<size_t>(alignment, 4096);
+        size_t nels = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<size_t>());
+        std::string header = create_npy_header(shape, map_type(typeid(T)), sizeof(T), alignment);
+        if (npy_write_direct(fname, header, (const char*)data, sizeof(T) * nels)) {
+            return;
+        }
+    }
     std::vector<size_t> true_data_shape;  // if appending, the shape of existing + new data
     std::fstream fs;
     if (mode == "a") {
@@ -120,6 +265,21 @@ void npy_save(std::string fname, const T* data, const std::vector<size_t> shape,
             }
         }
         true_data_shape[0] += shape[0];
+        // the grown header is rewritten in place at its old length, which keeps the existing
+        // payload (and its alignment) where it is; the new data goes at the end
+        size_t header_len = (size_t)fs.tellg();
+        std::string header =
+            create_npy_header(true_data_shape, map_type(typeid(T)), sizeof(T), header_len);
+        if (header.size() != header_len) {
+            throw std::runtime_error("npy_save: no room to grow the header of " + fname);
+        }
+        size_t nels = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<size_t>());
+        fs.seekp(0, std::ios::beg);
+        fs.write(&header[0], header.size());
+        fs.seekp(0, std::ios::end);
+        fs.write((const char*)data, sizeof(T) * nels);
+        fs.close();
+        return;
     } else {
         true_data_shape = shape;
         fs.open(fname, std::ios::out | std::ios::binary);
@@ -127,7 +287,8 @@ void npy_save(std::string fname, const T* data, const std::vector<size_t> shape,
             throw std::runtime_error("Can't open file: " + fname + "for write.");
         }
     }
-    std::string header = create_npy_header(true_data_shape, map_type(typeid(T)), sizeof(T));
+    std::string header =
+        create_npy_header(true_data_shape, map_type(typeid(T)), sizeof(T), alignment);
     size_t nels = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<size_t>());
     fs.write(&header[0], header.size());
     fs.write((const char*)data, sizeof(T) * nels);
@@ -136,7 +297,8 @@ void npy_save(std::string fname, const T* data, const std::vector<size_t> shape,
 
 template <typename T>
 void npz_save(std::string zipname, std::string fname, const T* data,
-              const std::vector<size_t>& shape, std::string mode = "w") {
+              const std::vector<size_t>& shape, std::string mode = "w",
+              const SavePolicy& policy = SavePolicy(), save_stats_t* stats = nullptr) {
     // first, append a .npy to the fname
     fname += ".npy";
     // now, on with the show
@@ -178,36 +340,73 @@ void npz_save(std::string zipname, std::string fname, const T* data,
     // get the CRC of the data to be added
     uint32_t crc = crc32(0L, (void*)&npy_header[0], npy_header.size());
     crc = crc32(crc, (uint8_t*)data, nels * sizeof(T));
-    // build the local header
-    auto local_header = create_local_header(fname, crc, nbytes);
+    // decide how to store the member; deflated members come back in compressed
+    std::string compressed;
+    uint16_t compr_method = compress_member(fname, npy_header, (const char*)data,
+                                            nels * sizeof(T), policy, compressed, stats);
+    size_t compr_bytes = compr_method ? compressed.size() : nbytes;
+    // build the local header, padded so a stored payload lands on policy.alignment
+    uint16_t padding = compr_method ? 0
+                                    : npz_payload_padding(global_header_offset, fname.size(),
+                                                          npy_header.size(), policy.alignment);
+    auto local_header =
+        create_local_header(fname, crc, nbytes, compr_bytes, compr_method, padding,
+                            (uint16_t)policy.alignment);
     // build global header
     auto cur_global_header = create_global_header(fname, local_header, global_header_offset);
     global_header += cur_global_header;
-    global_header_offset += (nbytes + local_header.size());
+    global_header_offset += (compr_bytes + local_header.size());
     // build footer
     auto footer = create_footer(nrecs + 1, global_header.size(), global_header_offset);
     // write everything
     fs.write(&local_header[0], local_header.size());
-    fs.write(&npy_header[0], npy_header.size());
-    fs.write((const char*)data, nels * sizeof(T));
+    if (compr_method) {
+        fs.write(&compressed[0], compressed.size());
+    } else {
+        fs.write(&npy_header[0], npy_header.size());
+        fs.write((const char*)data, nels * sizeof(T));
+    }
     fs.write(&global_header[0], global_header.size());
     fs.write(&footer[0], footer.size());
     fs.close();
 }
 
 template <typename T>
-void npy_save(std::string fname, const std::vector<T> data, std::string mode = "w") {
+void npy_save_sharded(const std::string& prefix, const T* data, const std::vector<size_t>& shape,
+                      size_t nshards, size_t num_threads = 0,
+                      const SavePolicy& policy = SavePolicy()) {
+    npy_save_sharded(prefix, (const char*)data, shape, map_type(typeid(T)), sizeof(T), nshards,
+                     num_threads, policy);
+}
+
+template <typename T>
+void npz_update(std::string zipname, std::string varname, const T* data,
+                const std::vector<size_t>& shape) {
+    npz_update(zipname, varname, (const char*)data, shape, map_type(typeid(T)), sizeof(T));
+}
+
+template <typename T>
+void npy_save(std::string fname, const std::vector<T> data, std::string mode = "w",
+              const SavePolicy& policy = SavePolicy()) {
     std::vector<size_t> shape;
     shape.push_back(data.size());
-    npy_save(fname, &data[0], shape, mode);
+    npy_save(fname, &data[0], shape, mode, policy);
 }
 
 template <typename T>
 void npz_save(std::string zipname, std::string fname, const std::vector<T> data,
-              std::string mode = "w") {
+              std::string mode = "w", const SavePolicy& policy = SavePolicy(),
+              save_stats_t* stats = nullptr) {
+    std::vector<size_t> shape;
+    shape.push_back(data.size());
+    npz_save(zipname, fname, &data[0], shape, mode, policy, stats);
+}
+
+template <typename T>
+void npz_update(std::string zipname, std::string varname, const std::vector<T> data) {
     std::vector<size_t> shape;
     shape.push_back(data.size());
-    npz_save(zipname, fname, &data[0], shape, mode);
+    npz_update(zipname, varname, &data[0], shape);
 }
 }  // namespace cnpy
 
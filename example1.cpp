@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <complex>
 #include <cstdlib>
 #include <iostream>
@@ -50,6 +51,190 @@ void test_type_id() {
     std::cout << std::dec;
 }
 
+static size_t file_size(const std::string& fname) {
+    std::ifstream ifs(fname, std::ios::binary | std::ios::ate);
+    return ifs.tellg();
+}
+
+void test_npz_update() {
+    std::vector<double> a(1000, 1.0), b(1000, 2.0), c(500, 3.0);
+    std::vector<int> m(10, 7);
+    cnpy::npz_save("update.npz", "a", a, "w");
+    cnpy::npz_save("update.npz", "m", m, "a");
+    size_t size = file_size("update.npz");
+
+    // same dtype and size: overwritten in place
+    cnpy::npz_update("update.npz", "a", b);
+    assert(file_size("update.npz") == size);
+    assert(cnpy::npz_load("update.npz", "a").as_vec<double>() == b);
+
+    // resized: appended, the old member is retired until npz_compact
+    cnpy::npz_update("update.npz", "a", c);
+    assert(file_size("update.npz") > size);
+    assert(cnpy::npz_load("update.npz", "a").as_vec<double>() == c);
+    cnpy::npz_compact("update.npz");
+    assert(file_size("update.npz") < size);
+
+    cnpy::npz_t arrays = cnpy::npz_load("update.npz");
+    assert(arrays.size() == 2);
+    assert(arrays["a"].as_vec<double>() == c);
+    assert(arrays["m"].as_vec<int>() == m);
+    std::cout << "npz update success " << std::endl;
+}
+
+void test_dataset_iterator() {
+    // two good shards of 10 records each, and one whose members differ in length
+    std::vector<std::string> files = {"shard0.npz", "shard_bad.npz", "shard1.npz"};
+    for (int f = 0; f < 2; ++f) {
+        std::vector<int> x(10 * 3), y(10);
+        for (int i = 0; i < 10; ++i) {
+            y[i] = f * 100 + i;
+            for (int j = 0; j < 3; ++j) x[i * 3 + j] = y[i];
+        }
+        std::string fname = "shard" + std::to_string(f) + ".npz";
+        cnpy::npz_save(fname, "x", &x[0], {10, 3}, "w");
+        cnpy::npz_save(fname, "y", y, "a");
+    }
+    cnpy::npz_save("shard_bad.npz", "x", std::vector<int>(6), "w");
+    cnpy::npz_save("shard_bad.npz", "y", std::vector<int>(5), "a");
+
+    for (int shuffle = 0; shuffle < 2; ++shuffle) {
+        cnpy::NpzDatasetIterator it(files, {"x", "y"}, 4, 2, 2, shuffle, shuffle, 7);
+        cnpy::npz_t batch;
+        std::vector<int> seen;
+        int errors = 0;
+        while (1) {
+            try {
+                if (!it.next(batch)) break;
+            } catch (std::runtime_error&) {
+                ++errors;
+                continue;
+            }
+            const cnpy::NpyArray& x = batch["x"];
+            const cnpy::NpyArray& y = batch["y"];
+            assert(x.shape[0] == y.shape[0] && x.shape[0] <= 4 && x.shape[1] == 3);
+            for (size_t i = 0; i < y.shape[0]; ++i) {
+                assert(x.data<int>()[i * 3 + 2] == y.data<int>()[i]);
+                seen.push_back(y.data<int>()[i]);
+            }
+        }
+        std::sort(seen.begin(), seen.end());
+        assert(errors == 1 && seen.size() == 20);
+        assert(seen.front() == 0 && seen.back() == 109);
+    }
+    std::cout << "dataset iterator success " << std::endl;
+}
+
+void test_save_policy() {
+    // random floats don't compress, a blocky mask does
+    std::vector<float> emb(100000);
+    for (auto& v : emb) v = rand() / (float)RAND_MAX;
+    std::vector<int> mask(100000);
+    for (size_t i = 0; i < mask.size(); ++i) mask[i] = (i / 1000) % 2;
+
+    cnpy::save_stats_t stats;
+    cnpy::SavePolicy policy(6, true);
+    cnpy::npz_save("policy.npz", "emb", emb, "w", policy, &stats);
+    cnpy::npz_save("policy.npz", "mask", mask, "a", policy, &stats);
+    assert(stats.size() == 2);
+    assert(stats[0].name == "emb" && stats[0].compr_method == 0 && stats[0].ratio == 1.0);
+    assert(stats[1].name == "mask" && stats[1].compr_method == 8 && stats[1].ratio < 0.1);
+    assert(file_size("policy.npz") < emb.size() * sizeof(float) + mask.size() * sizeof(int) / 2);
+
+    cnpy::npz_t arrays = cnpy::npz_load("policy.npz");
+    assert(arrays["emb"].as_vec<float>() == emb && arrays["mask"].as_vec<int>() == mask);
+
+    std::ifstream ifs("policy.npz", std::ios::binary);
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    std::string buffer = ss.str();
+    arrays = cnpy::npz_load_buffer(buffer);
+    assert(arrays["emb"].as_vec<float>() == emb && arrays["mask"].as_vec<int>() == mask);
+
+    stats.clear();
+    buffer = cnpy::npz_save_buffer(arrays, policy, &stats);
+    assert(stats.size() == 2 && stats[1].compr_method == 8);
+    arrays = cnpy::npz_load_buffer(buffer);
+    assert(arrays["emb"].as_vec<float>() == emb && arrays["mask"].as_vec<int>() == mask);
+    std::cout << "save policy success " << std::endl;
+}
+
+// file offsets of every npy payload in fname, found from the npy magic of each member
+static std::vector<size_t> payload_offsets(const std::string& fname) {
+    std::ifstream ifs(fname, std::ios::binary);
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    std::string raw = ss.str();
+    std::vector<size_t> offsets;
+    const std::string magic = "\x93NUMPY\x01\x00";
+    for (size_t pos = raw.find(magic); pos != std::string::npos; pos = raw.find(magic, pos + 1)) {
+        offsets.push_back(pos + 10 + *(uint16_t*)&raw[pos + 8]);
+    }
+    return offsets;
+}
+
+void test_alignment_and_direct_io() {
+    std::vector<double> x(77, 1.5);
+    cnpy::npy_save("aligned.npy", &x[0], {7, 11}, "w", cnpy::SavePolicy(0, false, 64));
+    assert(payload_offsets("aligned.npy")[0] % 64 == 0);
+
+    cnpy::npz_save("aligned.npz", "a", x, "w", cnpy::SavePolicy(0, false, 64));
+    cnpy::npz_save("aligned.npz", "bb", x, "a", cnpy::SavePolicy(0, false, 4096));
+    cnpy::npz_save("aligned.npz", "ccc", x, "a", cnpy::SavePolicy(0, false, 64));
+    std::vector<size_t> offsets = payload_offsets("aligned.npz");
+    assert(offsets.size() == 3);
+    assert(offsets[0] % 64 == 0 && offsets[1] % 4096 == 0 && offsets[2] % 64 == 0);
+    // a resizing update and a compaction keep the alignment of the member
+    cnpy::npz_update("aligned.npz", "a", std::vector<double>(5, 2.5));
+    cnpy::npz_compact("aligned.npz");
+    for (size_t offset : payload_offsets("aligned.npz")) assert(offset % 64 == 0);
+    assert(cnpy::npz_load("aligned.npz", "a").as_vec<double>() == std::vector<double>(5, 2.5));
+
+    // O_DIRECT round trip of a payload that isn't a whole number of blocks
+    std::vector<double> y(1001);
+    for (size_t i = 0; i < y.size(); ++i) y[i] = i * 0.25;
+    cnpy::npy_save("direct.npy", &y[0], {y.size()}, "w", cnpy::SavePolicy(0, false, 0, true));
+    assert(file_size("direct.npy") == 4096 + y.size() * sizeof(double));
+    assert(cnpy::npy_load("direct.npy", true).as_vec<double>() == y);
+    assert(cnpy::npy_load("direct.npy").as_vec<double>() == y);
+    std::cout << "alignment and direct io success " << std::endl;
+}
+
+void test_sharded() {
+    std::vector<float> x(1001 * 7);
+    for (size_t i = 0; i < x.size(); ++i) x[i] = i;
+    cnpy::npy_save_sharded("sharded", &x[0], {1001, 7}, 4);
+
+    std::vector<cnpy::NpyArray> views;
+    cnpy::NpyArray arr = cnpy::npy_load_sharded("sharded", &views, 2);
+    assert(arr.shape.size() == 2 && arr.shape[0] == 1001 && arr.shape[1] == 7);
+    assert(arr.as_vec<float>() == x);
+    assert(views.size() == 4);
+    size_t rows = 0;
+    for (const cnpy::NpyArray& view : views) {
+        assert(view.data<float>()[0] == rows * 7);
+        rows += view.shape[0];
+    }
+    assert(rows == 1001);
+    // each shard is a plain npy file
+    assert(cnpy::npy_load("sharded.shard1.npy").data<float>()[0] == 250 * 7);
+
+    // a flipped payload byte must fail the checksum
+    {
+        std::fstream fs("sharded.shard2.npy", std::ios::in | std::ios::out | std::ios::binary);
+        fs.seekp(-1, std::ios::end);
+        fs.put(0x7f);
+    }
+    bool caught = false;
+    try {
+        cnpy::npy_load_sharded("sharded");
+    } catch (std::runtime_error&) {
+        caught = true;
+    }
+    assert(caught);
+    std::cout << "sharded save/load success " << std::endl;
+}
+
 int main() {
     test_type_id();
     double startTime, duration;
@@ -128,4 +313,10 @@ int main() {
     double* mv1 = arr_mv1.data<double>();
     assert(arr_mv1.shape.size() == 1 && arr_mv1.shape[0] == 1);
     assert(mv1[0] == myVar1);
+
+    test_npz_update();
+    test_dataset_iterator();
+    test_save_policy();
+    test_alignment_and_direct_io();
+    test_sharded();
 }